@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Script startup benchmark: runs a generated 100k-line script without the
+# .dshc cache, with a cold cache (parse + write) and with a warm cache.
+# Only builtins are used so that fork/exec does not drown the parsing cost.
+# Usage: tests/bench_script_cache.sh [lines]
+
+set -euo pipefail
+
+DSH="./dsh"
+LINES="${1:-100000}"
+WORK_DIR="$(mktemp -d)"
+SCRIPT="${WORK_DIR}/script.dsh"
+export DSH_SCRIPT_CACHE_DIR="${WORK_DIR}/cache"
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+for i in $(seq 1 "${LINES}"); do
+    echo "cd . /some/generated/path/${i} --option=value_${i} 'quoted argument ${i}' \"double quoted\" escaped\\ arg > /dev/null"
+done > "${SCRIPT}"
+echo "Script: ${LINES} lines, $(wc -c < "${SCRIPT}") bytes"
+
+run() {
+    local label="$1"
+    shift
+    local start end
+    start=$(date +%s.%N)
+    env "$@" "${DSH}" "${SCRIPT}"
+    end=$(date +%s.%N)
+    awk -v label="${label}" -v start="${start}" -v end="${end}" 'BEGIN { printf "%-12s %7.3f s\n", label, end - start }'
+}
+
+run "no cache" DSH_SCRIPT_CACHE=off
+run "cold cache" DSH_SCRIPT_CACHE=on
+run "warm cache" DSH_SCRIPT_CACHE=on
+ls -l "${DSH_SCRIPT_CACHE_DIR}" | tail -n +2 | awk -v script="$(wc -c < "${SCRIPT}")" \
+    '{ printf "Cache file: %d bytes (%.2fx the script)\n", $5, $5 / script }'
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Tokenizer throughput benchmark: feeds the same builtin-only input (no fork
+# per line) through dsh with each scanner and reports input bytes per second.
+# Usage: tests/bench_tokenizer.sh [lines]
+
+set -euo pipefail
+
+DSH="./dsh"
+LINES="${1:-200000}"
+INPUT="$(mktemp)"
+trap 'rm -f "${INPUT}"' EXIT
+
+# Long plain arguments with a few quoted and escaped ones, ~900 bytes per line
+ARGS=""
+for i in $(seq 1 12); do
+    ARGS+=" /usr/local/share/some/long/plain/path/component_${i}/file_name_${i}.txt"
+done
+ARGS+=" 'a single quoted argument with spaces' \"a double quoted one\" escaped\\ space"
+for i in $(seq 1 "${LINES}"); do
+    echo "echo${ARGS}"
+done > "${INPUT}"
+
+BYTES=$(wc -c < "${INPUT}")
+echo "Input: ${LINES} lines, ${BYTES} bytes"
+
+for mode in scalar sse2 avx2; do
+    START=$(date +%s.%N)
+    cat "${INPUT}" | DSH_TOKENIZER="${mode}" "${DSH}" > /dev/null
+    END=$(date +%s.%N)
+    awk -v mode="${mode}" -v start="${START}" -v end="${END}" -v bytes="${BYTES}" \
+        'BEGIN { t = end - start; printf "%-7s %7.3f s  %8.1f MB/s\n", mode, t, bytes / t / 1e6 }'
+done
@@ -0,0 +1,128 @@
+#!/bin/bash
+
+# Set strict mode
+set -euo pipefail
+
+. tests/test_helper.sh
+
+echo "--- Testing history ---"
+
+# History is recorded for piped input only when DSH_HISTFILE is set
+export DSH_HISTFILE="$(mktemp)"
+trap 'rm -f "${DSH_HISTFILE}" "${DSH_HISTFILE}".idx*' EXIT
+
+assert_output "echo first
+echo second
+history" "first
+second
+    1  echo first
+    2  echo second
+    3  history" "history lists entries"
+
+# The file is shared: a new shell sees the entries of the previous one
+assert_output "!1" "first" "!n recalls an entry from an earlier session"
+assert_output "!!" "first" "!! recalls the previous entry"
+assert_output "!-4" "second" "!-n recalls relative to the end"
+assert_output "!echo s" "second s" "!prefix recalls the newest match"
+assert_output "!nosuchcommand" "dsh: !nosuchcommand: event not found" "unknown event is reported"
+assert_output "echo '!1'" "!1" "no expansion inside single quotes"
+
+assert_output "history -p 'echo f'" "    1  echo first
+    4  echo first
+    5  echo first" "history -p searches by prefix"
+assert_output "history -s cond" "    2  echo second
+    6  echo second
+    7  echo second s
+   10  history -s cond" "history -s searches by substring"
+
+# history runs in the child like any other command, so pipes and redirections apply
+assert_output "history | grep second" "    2  echo second
+    6  echo second
+    7  echo second s
+   11  history | grep second" "history in a pipeline"
+HOUT="$(mktemp)"
+assert_output "history 2 > ${HOUT}
+cat ${HOUT}" "   11  history | grep second
+   12  history 2 > ${HOUT}" "history with an output redirection"
+rm -f "${HOUT}"
+
+# Large histories are searched through the background-built trigram index
+seq 1 20000 | sed 's/^/echo entry /' > "${DSH_HISTFILE}"
+assert_output "echo start" "start" "large history file"
+for i in $(seq 1 50); do
+    [ -f "${DSH_HISTFILE}.idx" ] && break
+    sleep 0.1
+done
+[ -f "${DSH_HISTFILE}.idx" ] || { echo "FAIL: history index was not built"; exit 1; }
+assert_output "!12345" "entry 12345" "!n through the index"
+assert_output "history -s 'entry 1999'" " 1999  echo entry 1999
+19990  echo entry 19990
+19991  echo entry 19991
+19992  echo entry 19992
+19993  echo entry 19993
+19994  echo entry 19994
+19995  echo entry 19995
+19996  echo entry 19996
+19997  echo entry 19997
+19998  echo entry 19998
+19999  echo entry 19999
+20003  history -s 'entry 1999'" "history -s through the index"
+
+# Entries appended later are indexed as a new segment next to the existing one
+seq 1 5000 | sed 's/^/echo extra /' >> "${DSH_HISTFILE}"
+assert_output "echo again" "again" "history grows past the reindex threshold"
+num_segments() { od -A n -t u8 -j 16 -N 8 "${DSH_HISTFILE}.idx" | tr -d ' '; }
+for i in $(seq 1 50); do
+    [ "$(num_segments)" = 2 ] && break
+    sleep 0.1
+done
+[ "$(num_segments)" = 2 ] || { echo "FAIL: new entries were not indexed as a segment"; exit 1; }
+assert_output "history -s 4999" " 4999  echo entry 4999
+14999  echo entry 14999
+25002  echo extra 4999
+25005  history -s 4999" "history -s across segments"
+assert_output "!25000" "extra 4997" "!n in the newer segment"
+
+# Files larger than a segment are indexed in 1 MiB chunks: the first two are
+# merged, the small third one is kept apart
+rm -f "${DSH_HISTFILE}".idx*
+seq 1 150000 | sed 's/^/echo big /' > "${DSH_HISTFILE}"
+assert_output "echo start" "start" "history larger than a segment"
+for i in $(seq 1 100); do
+    [ "$(num_segments)" = 2 ] && break
+    sleep 0.1
+done
+[ "$(num_segments)" = 2 ] || { echo "FAIL: history index segments were not merged"; exit 1; }
+assert_output "history -s 'big 14999'" "14999  echo big 14999
+149990  echo big 149990
+149991  echo big 149991
+149992  echo big 149992
+149993  echo big 149993
+149994  echo big 149994
+149995  echo big 149995
+149996  echo big 149996
+149997  echo big 149997
+149998  echo big 149998
+149999  echo big 149999
+150002  history -s 'big 14999'" "history -s through merged segments"
+assert_output "!70000" "big 70000" "!n through merged segments"
+
+# A corrupted segment is ignored, its entries are scanned, and the next
+# rebuild replaces it
+first_segment() { echo "${DSH_HISTFILE}.idx.$(od -A n -t u8 -j 24 -N 8 "${DSH_HISTFILE}.idx" | tr -d ' ')"; }
+corrupt() { printf '\377\377\377\377\377\377\377\177' | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null; }
+SEGMENT="$(first_segment)"
+corrupt "$SEGMENT" 56 # Offset of the second line
+assert_output "!2" "big 2" "!n with a corrupted line offset"
+assert_output "history -p 'echo big 149999'" "149999  echo big 149999" "history -p with a corrupted line offset"
+for i in $(seq 1 100); do
+    [ "$(first_segment)" != "$SEGMENT" ] && [ "$(num_segments)" = 2 ] && break
+    sleep 0.1
+done
+[ "$(first_segment)" != "$SEGMENT" ] || { echo "FAIL: corrupted history index was not rebuilt"; exit 1; }
+SEGMENT="$(first_segment)"
+LINES=$(od -A n -t u8 -j 24 -N 8 "$SEGMENT" | tr -d ' ')
+corrupt "$SEGMENT" $((48 + 8 * LINES + 8)) # First posting of the first trigram
+assert_output "history -s 'big 14999' | head -1" "14999  echo big 14999" "history -s with a corrupted trigram table"
+
+echo "--- history Tests Complete ---"
@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# Set strict mode
+set -euo pipefail
+
+. tests/test_helper.sh
+
+echo "--- Testing memo ---"
+
+# Keep the cache out of the user's home directory
+export DSH_MEMO_DIR="$(mktemp -d)"
+trap 'rm -rf "${DSH_MEMO_DIR}" memo_counter.txt memo_input.txt memo_tty.dsh' EXIT
+
+# Commands read /dev/null here: stdin inherited from the shell is a pipe,
+# which memo never caches. A terminal is keyed like a device (see below).
+
+# A miss runs the command, a hit replays its stdout without running it
+assert_output "memo sh -c 'echo run >> memo_counter.txt; echo cached output' < /dev/null" "cached output" "memo miss runs the command"
+assert_output "memo sh -c 'echo run >> memo_counter.txt; echo cached output' < /dev/null" "cached output" "memo hit replays stdout"
+assert_output "cat memo_counter.txt" "run" "memo hit does not run the command again"
+
+# The exit status is replayed too
+assert_output "memo sh -c 'exit 3' < /dev/null
+printenv ?" "3" "memo miss saves the exit status"
+assert_output "memo sh -c 'exit 3' < /dev/null
+printenv ?" "3" "memo hit replays the exit status"
+
+# Replay into a pipe
+assert_output "memo sh -c 'echo run >> memo_counter.txt; echo cached output' < /dev/null | tr a-z A-Z" "CACHED OUTPUT" "memo hit replays into a pipeline"
+
+# A changed input file is a different key
+echo "first" > memo_input.txt
+assert_output "memo cat < memo_input.txt" "first" "memo with input file"
+echo "second version" > memo_input.txt
+assert_output "memo cat < memo_input.txt" "second version" "memo notices a changed input file"
+
+# Piped input is not keyed, so the command always runs
+assert_output "echo a | memo cat
+echo b | memo cat" "a
+b" "memo does not cache piped stdin"
+assert_output "memo cat 3< memo_input.txt <&3" "second version" "memo keys stdin by file identity, however it was redirected"
+# Temporaries of killed recordings are swept when a new entry is stored
+touch -d '2 minutes ago' "${DSH_MEMO_DIR}/.tmp.999999"
+touch "${DSH_MEMO_DIR}/.tmp.999998"
+assert_output "memo echo sweep < /dev/null" "sweep" "memo records a new entry"
+[ ! -e "${DSH_MEMO_DIR}/.tmp.999999" ] || { echo "FAIL: stale memo temporary was not removed"; exit 1; }
+[ -e "${DSH_MEMO_DIR}/.tmp.999998" ] || { echo "FAIL: recent memo temporary was removed"; exit 1; }
+echo "PASS: memo removes stale temporaries"
+rm -f "${DSH_MEMO_DIR}/.tmp.999998"
+
+assert_output "memo --stats | head -n 3" "hits: 4
+misses: 5
+hit rate: 44.4%" "memo --stats reports the hit rate"
+assert_output "memo --stats | tail -n 1" "uncached runs (piped stdin): 2" "memo --stats counts uncached runs"
+
+# Interactive use: on a terminal stdin, the second run is a hit
+if command -v script > /dev/null; then
+    printf '%s\n' "memo sh -c 'echo ran >&2; echo tty output'" "memo sh -c 'echo ran >&2; echo tty output'" > memo_tty.dsh
+    TTY_OUTPUT=$(DSH_SCRIPT_CACHE=off script -qec "${DSH} memo_tty.dsh" /dev/null < /dev/null | tr -d '\r')
+    if [ "${TTY_OUTPUT}" = "ran
+tty output
+tty output" ]; then
+        echo "PASS: memo caches commands run from a terminal"
+    else
+        echo "FAIL: memo caches commands run from a terminal"
+        echo "  Actual: '${TTY_OUTPUT}'"
+        exit 1
+    fi
+fi
+
+echo "--- memo Tests Complete ---"
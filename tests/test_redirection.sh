@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Set strict mode
+set -euo pipefail
+
+. tests/test_helper.sh
+
+# Run from a scratch directory so that redirections and the pipeline below
+# stay short
+DSH="$PWD/dsh"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+echo "--- Testing redirections ---"
+
+echo "hello" > in.txt
+
+assert_output "sh -c 'echo out; echo err >&2' 2> err.txt
+cat err.txt" "out
+err" "2> redirects stderr"
+assert_output "sh -c 'echo err >&2' 2>&1 | tr a-z A-Z" "ERR" "2>&1 sends stderr down the pipe"
+assert_output "sh -c 'echo out; echo err >&2' > both.txt 2>&1
+cat both.txt" "out
+err" "> file 2>&1 sends both to the file"
+assert_output "sh -c 'echo out; echo err >&2' 2>&1 > out.txt | tr a-z A-Z
+cat out.txt" "ERR
+out" "2>&1 > file keeps stderr on the old stdout"
+assert_output "sh -c 'echo out; echo err >&2' &> amp.txt
+sh -c 'echo more >&2' &>> amp.txt
+cat amp.txt" "out
+err
+more" "&> and &>> redirect stdout and stderr"
+assert_output "sh -c 'echo out; echo err >&2' >& old.txt
+cat old.txt" "out
+err" ">&file is the same as &>file"
+assert_output "cat 3< in.txt /dev/fd/3" "hello" "n< opens a file on fd n"
+assert_output "sh -c 'cat <&4' 4< in.txt" "hello" "<&n duplicates an input descriptor"
+assert_output "sh -c '[ -e /proc/self/fd/1 ] && echo open >&2; echo done >&2' >&-" "done" ">&- closes stdout"
+assert_output "cat <&7" "dsh: 7: Bad file descriptor" "duplicating a closed descriptor fails"
+assert_output "cat 2>" "dsh: missing filename for output redirection" "missing filename is an error"
+assert_output "cat 2>&" "dsh: missing file descriptor for duplication" "missing descriptor is an error"
+
+# Each stage reports every descriptor beyond 0-2 it inherited, other than the
+# one its own shell reads the script from
+cat > f <<'EOF'
+#!/bin/sh
+n=3
+while [ $n -lt 1024 ]; do
+    if [ -e /proc/$$/fd/$n ] && [ "$(readlink /proc/$$/fd/$n)" != "$PWD/f" ]; then
+        echo "leaked fd $n" >&2
+    fi
+    n=$((n + 1))
+done
+exec cat
+EOF
+chmod +x f
+
+assert_output "./f 5< in.txt < in.txt" "leaked fd 5
+hello" "descriptors opened by a redirection are inherited"
+assert_output "./f 5< in.txt 5<&- < in.txt" "hello" "n<&- closes a descriptor"
+assert_output "./f < in.txt" "hello" "redirecting stdin leaks no descriptor"
+
+PIPELINE="./f < in.txt"
+for i in $(seq 99); do PIPELINE="$PIPELINE | ./f"; done
+assert_output "$PIPELINE" "hello" "no stage of a 100-command pipeline inherits another's pipe"
+
+echo "--- Redirection Tests Complete ---"
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Set strict mode
+set -euo pipefail
+
+echo "--- Testing script mode and .dshc cache ---"
+
+WORK_DIR="$(mktemp -d)"
+SCRIPT="${WORK_DIR}/script.dsh"
+export DSH_SCRIPT_CACHE_DIR="${WORK_DIR}/cache"
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+# Usage: assert_script "expected output" "description"
+assert_script() {
+    local actual_output
+    actual_output=$(./dsh "${SCRIPT}" 2>&1)
+    if [ "${actual_output}" = "$1" ]; then
+        echo "PASS: $2"
+    else
+        echo "FAIL: $2"
+        echo "  Expected: '$1'"
+        echo "  Actual:   '${actual_output}'"
+        exit 1
+    fi
+}
+
+cat > "${SCRIPT}" <<'SCRIPT'
+ls /nonexistent_dsh_test_dir
+printenv ?
+echo "unterminated
+echo hello world | tr a-z A-Z
+/bin/echo 'quoted arg' escaped\ arg "a \"b\" c"
+
+exit
+/bin/echo not reached
+SCRIPT
+EXPECTED="ls: cannot access '/nonexistent_dsh_test_dir': No such file or directory
+2
+dsh: unmatched quote or incomplete escape sequence
+HELLO WORLD
+quoted arg escaped arg a \"b\" c
+Goodbye!"
+
+assert_script "${EXPECTED}" "script runs and builds the cache"
+[ -n "$(ls "${DSH_SCRIPT_CACHE_DIR}"/*.dshc)" ] || { echo "FAIL: no .dshc file written"; exit 1; }
+assert_script "${EXPECTED}" "script runs from the cache"
+
+actual_output=$(DSH_SCRIPT_CACHE=off ./dsh "${SCRIPT}" 2>&1)
+[ "${actual_output}" = "${EXPECTED}" ] && echo "PASS: uncached run matches" || { echo "FAIL: uncached run differs"; exit 1; }
+
+# A changed script must not run stale commands
+sed -i 's/^exit$/\/bin\/echo changed/' "${SCRIPT}"
+assert_script "${EXPECTED%Goodbye!}changed
+not reached" "cache is rebuilt when the script changes"
+
+# A damaged cache is ignored and rebuilt
+for cache in "${DSH_SCRIPT_CACHE_DIR}"/*.dshc; do
+    printf 'garbage' | dd of="${cache}" bs=1 seek=100 conv=notrunc status=none
+done
+assert_script "${EXPECTED%Goodbye!}changed
+not reached" "corrupt cache is rebuilt"
+
+# Repeated arguments and redirections are stored once
+OUT="${WORK_DIR}/out.txt"
+{
+    for i in $(seq 1 1000); do echo "cd . > /dev/null"; done
+    echo "/bin/echo first > ${OUT}"
+    echo "/bin/echo second >> ${OUT}"
+    echo "/bin/echo first >> ${OUT}"
+    echo "cat ${OUT}"
+} > "${SCRIPT}"
+assert_script "first
+second
+first" "script with repeated lines runs and builds the cache"
+assert_script "first
+second
+first" "script with repeated lines runs from the cache"
+cache_size=$(stat -c %s "${DSH_SCRIPT_CACHE_DIR}"/*.dshc)
+# An entry (12 bytes) and two argument references per line, plus the rest once
+[ "${cache_size}" -lt $((1000 * 20 + 1024)) ] && echo "PASS: repeated strings are shared" \
+    || { echo "FAIL: cache is ${cache_size} bytes"; exit 1; }
+
+echo "--- Script Tests Complete ---"
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Set strict mode
+set -euo pipefail
+
+. tests/test_helper.sh
+
+echo "--- Testing timeout and ulimit ---"
+
+assert_output "timeout 0.2 sleep 5
+printenv ?" "124" "timeout returns 124 at the deadline"
+assert_output "timeout 5 sh -c 'exit 7'
+printenv ?" "7" "timeout passes the exit status through"
+assert_output "timeout 5 echo done" "done" "timeout runs the command"
+assert_output "timeout -k 0.2 0.2 sh -c 'trap \"\" TERM; sleep 5'
+printenv ?" "124" "timeout sends SIGKILL after the grace period"
+assert_output "timeout abc sleep 1
+printenv ?" "timeout: invalid time interval 'abc'
+125" "timeout rejects a bad duration"
+
+# The whole process group is killed, so the reader sees EOF right away
+START=$(date +%s)
+assert_output "timeout 0.5 sh -c 'sleep 30 & sleep 30' | cat" "" "timeout kills background children of the command"
+assert_output "echo hello | timeout 5 tr a-z A-Z | timeout 0.2 sleep 10" "" "timeout in every pipeline stage"
+[ $(( $(date +%s) - START )) -lt 10 ] || { echo "FAIL: timed out pipeline stages kept running"; exit 1; }
+
+# The inner timeout forwards the outer one's SIGTERM to its command's group
+assert_output "timeout 0.5 timeout 30 sleep 41
+printenv ?" "124" "nested timeout returns 124"
+for i in $(seq 20); do pgrep -f '^sleep 41$' > /dev/null || break; sleep 0.1; done
+if pgrep -f '^sleep 41$' > /dev/null; then
+    pkill -f '^sleep 41$'
+    echo "FAIL: nested timeout left its command running"
+    exit 1
+fi
+echo "PASS: nested timeout kills the inner command"
+
+# A timed out run is cut short at an arbitrary point and must not be cached
+export DSH_MEMO_DIR="$(mktemp -d)"
+trap 'rm -rf "${DSH_MEMO_DIR}"' EXIT
+for run in 1 2; do
+    assert_output "memo timeout 0.3 sh -c 'echo partial; sleep 2; echo full' < /dev/null
+printenv ?" "partial
+124" "memo does not replay a timed out command (run ${run})"
+done
+assert_output "memo --stats | head -n 2" "hits: 0
+misses: 2" "memo never stored the timed out result"
+
+assert_output "ulimit -n 32
+sh -c 'ulimit -n'" "32" "ulimit -n applies to children"
+assert_output "ulimit -n 32
+ulimit -n" "open files                (-n) 32" "ulimit prints a limit"
+assert_output "ulimit -c 0 -n 40
+sh -c 'ulimit -c; ulimit -n' | cat" "0
+40" "ulimit applies to pipeline stages"
+assert_output "ulimit -t 1
+sh -c 'while :; do :; done'
+printenv ?" "137" "ulimit -t stops a runaway command"
+assert_output "ulimit -x" "ulimit: -x: invalid option
+ulimit: usage: ulimit [-a] [-c|-n|-t|-v [limit|unlimited]]..." "ulimit rejects unknown options"
+
+echo "--- timeout and ulimit Tests Complete ---"
@@ -0,0 +1,94 @@
+#!/bin/bash
+
+# Differential test of the tokenizer: every scanner (DSH_TOKENIZER) must
+# produce exactly the same tokens as the scalar state machine.
+
+# Set strict mode
+set -euo pipefail
+
+DSH="$(pwd)/dsh"
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+echo "--- Testing tokenizer fast path ---"
+
+CORPUS="${WORK_DIR}/corpus.txt"
+
+# Seed corpus: the command lines of the quoting and escaping tests
+cat > "${CORPUS}" <<'SEED'
+printf {%s} 'hello world'
+printf {%s} "hello world"
+printf {%s} hello\ world
+printf {%s} "hello \"world\""
+printf {%s} 'hello \'world\''
+printf {%s} hello\\world
+printf {%s} "hello 'world'" 'hello "world"' hello\ \'world\'
+printf {%s} 'quoted filename test' > "output file with spaces.txt"
+cat "output file with spaces.txt"
+printf {%s} 'escaped filename test' > output\ file\ with\ spaces.txt
+cat < "output file with spaces.txt"
+cat < output\ file\ with\ spaces.txt
+printf {%s} '*' "*" \*
+SEED
+
+# Random lines: long plain runs to exercise the vector loops, mixed with every
+# byte that changes the tokenizer state. '|' is left out, even quoted, because
+# such lines run as pipelines whose stages would interleave their output; '/'
+# is left out so that redirections stay inside each scanner's directory.
+RANDOM=42
+PIECES=(a b c x y z 0 9 . - _ ' ' ' ' ' ' '	' '\' '\ ' "'" '"' '<' '>' '>>' 'é' '=' '%'
+        aaaaaaaaaaaaaaaaaaaaaaaa bcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ
+        ' 0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz '
+        "'single quoted run with spaces, \"quotes\" and <redirections>'"
+        "'single quoted run with spaces, \"quotes\" and <redirections>'"
+        '"double quoted run with \" escapes and '"'"'quotes'"'"' inside"'
+        '"double quoted run with \" escapes and '"'"'quotes'"'"' inside"')
+for line in $(seq 1 1500); do
+    text="printf {%s} "
+    pieces=$((RANDOM % 24)) # Drawn here: a subshell would reseed RANDOM
+    for piece in $(seq 1 "${pieces}"); do
+        text+="${PIECES[$((RANDOM % ${#PIECES[@]}))]}"
+    done
+    printf '%s\n' "${text}" >> "${CORPUS}"
+done
+
+# The corpus is piped rather than redirected: children exiting on a seekable
+# stdin would move the shared offset under the shell.
+# Lines with > or >> print their tokens into files named by another token, so
+# the name and content of every file the run created are compared as well.
+# Mode "default" runs with DSH_TOKENIZER unset, i.e. the runtime selection.
+run_corpus() {
+    local tokenizer=(env DSH_TOKENIZER="$1")
+    [ "$1" = default ] && tokenizer=(env -u DSH_TOKENIZER)
+    mkdir "${WORK_DIR}/$1"
+    (cd "${WORK_DIR}/$1" && cat "${CORPUS}" | "${tokenizer[@]}" "${DSH}" > ../"$1".out 2>&1 || true)
+    (cd "${WORK_DIR}/$1" && find . -type f | LC_ALL=C sort | while IFS= read -r file; do
+        printf '=== %s\n' "${file}"
+        cat -- "${file}"
+        echo
+    done) > "${WORK_DIR}/$1.files"
+}
+
+run_corpus scalar
+FILES=$(grep -c '^=== ' "${WORK_DIR}/scalar.files" || true)
+for mode in sse2 avx2 auto default; do
+    run_corpus "${mode}"
+    for result in out files; do
+        if ! cmp -s "${WORK_DIR}/scalar.${result}" "${WORK_DIR}/${mode}.${result}"; then
+            echo "FAIL: ${mode} tokens differ from scalar (${result})"
+            diff -a "${WORK_DIR}/scalar.${result}" "${WORK_DIR}/${mode}.${result}" | head -n 20
+            exit 1
+        fi
+    done
+    echo "PASS: ${mode} tokens match scalar on $(wc -l < "${CORPUS}") lines and ${FILES} redirected files"
+done
+
+if [ "$(echo "echo ok" | DSH_TOKENIZER=bogus "${DSH}" 2>&1)" = "dsh: unknown DSH_TOKENIZER 'bogus', using auto
+ok" ]; then
+    echo "PASS: unknown DSH_TOKENIZER values are reported"
+else
+    echo "FAIL: unknown DSH_TOKENIZER value was not reported"
+    exit 1
+fi
+
+echo "--- Tokenizer Tests Complete ---"